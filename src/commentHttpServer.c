@@ -2,8 +2,15 @@
 
 We implement a very simple request logging http server.
 
-Before we even attempt to write the request to disk, we first check that
-it is valid UTF-8.
+The request pipeline itself (see commentPipeline.h) lives in the
+commentPipeline library, this file manages the worker processes and their
+listening sockets.
+
+Requests which fit into our buffer are checked to be valid UTF-8 before
+we even attempt to write them to disk. Larger requests are spliced
+directly into a temporary file in the comment directory, and are then
+validated. Only valid comments are renamed into place, invalid comments
+are unlinked.
 
 This code has been inspired from: https://github.com/ankushagarwal/nweb
 
@@ -34,7 +41,8 @@ The signal and zombie handling have been inspired by:
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
-#include <time.h>
+
+#include "commentPipeline.h"
 
 FILE *myLogFile = NULL;
 #define logger(args...) \
@@ -42,56 +50,9 @@ FILE *myLogFile = NULL;
 
 #define BUFFER_SIZE 8096
 
-char *requestTooLarge =
-  "HTTP/1.1 413 Request too large \n"
-  "Content-Type: text/html\n\n"
-  "<html><head><title>Your comment is too large</title></head><body>"
-  "<h1>Your comment is too large</h1>\n"
-  "<p>Long comments are really papers in their own right.</p> "
-  "<p>Please consider publishing your own paper and then providing a "
-  "reference to it as a comment.</p>"
-  "</body></html>" ;
-
-char *invalidUft8 =
-  "HTTP/1.1 415 Invalid UTF-8 \n"
-  "Content-Type: text/html\n\n"
-  "<html><head><title>Your comment is not valid utf-8</title></head><body>"
-  "<h1>Your comment is not valid utf-8</h1>\n"
-  "<p>We do not accept comments which are not valid utf-8</p>"
-  "</body></html>" ;
-
-char *couldNotCollectComment =
-  "HTTP/1.1 500 Server error \n"
-  "Content-Type: text/html\n\n"
-  "<html><head><title>Sorry... we could not record you comment at the moment</title></head><body>"
-  "<h1>Sorry... we could not record you comment at the moment</h1>"
-  "<p>Something went wrong with our server and we could not deal with your "
-  "comment. Please try again later.</p>"
-  "</body></html>" ;
-
-char *thankYou =
-  "HTTP/1.1 200 OK \n"
-  "Content-Type: text/html\n\n"
-  "<html><head><title>Thank you for your comment</title></head><body>"
-  "<h1>Thank you for your comment</h1>"
-  "<p>Thank you for your comment. Our editors will consider your comment to "
-  "determine if it conforms to our comment criteria.</p>"
-  "</body></html>" ;
-
 #define TRUE  1
 #define FALSE 0
 
-#define advanceByte {                        \
-	if ( bufferEnd <= curByte ) return FALSE ; \
-	curByte++ ;                                \
-}
-
-#define isOneByte    (( *curByte & 0b10000000 ) == 0b00000000 )
-#define isCharByte   (( *curByte & 0b11000000 ) == 0b10000000 )
-#define isTwoBytes   (( *curByte & 0b11100000 ) == 0b11000000 )
-#define isThreeBytes (( *curByte & 0b11110000 ) == 0b11100000 )
-#define isFourBytes  (( *curByte & 0b11111000 ) == 0b11110000 )
-
 ////////////////////////////////////////////////////////////////////////
 // Manage the children workers...
 
@@ -187,123 +148,6 @@ void installSignalHanders(void) {
 	sigaction(SIGTERM, &newAction, NULL) ;
 }
 
-////////////////////////////////////////////////////////////////////////
-// Validate the request to ensure it is valid UTF-8
-
-/*!
-
-  Work through the given buffer checking for valid UTF-8 tuples of bytes.
-
-  See: http://www.unicode.org/reports/tr36/ for UniCode security
-  considerations.
-
-*/
-int validUft8( char *buffer, int bytesRead) {
-  if ( (int)(strlen(buffer)) != bytesRead ) {
-    logger("ERROR: incorrect buffer size validating utf-8\n") ;
-    return FALSE ;
-  }
-  char *bufferEnd = buffer + bytesRead ;
-  for (char *curByte = buffer; curByte < bufferEnd ; curByte++) {
-
-  	if ( isOneByte ) continue;
-
-    // the start of a utf-8 character MUST not be a "charByte"
-    if ( isCharByte ) return FALSE ;
-
-  	if ( isTwoBytes ) {
-  		advanceByte ;
-  		if ( ! isCharByte ) return FALSE ;
-      continue ;
-   	}
-
-   	if ( isThreeBytes ) {
-   		advanceByte ;
-   		if ( ! isCharByte ) return FALSE ;
-   		advanceByte ;
-   		if ( ! isCharByte ) return FALSE ;
-      continue ;
-   	}
-
-    if ( isFourBytes ) {
-   		advanceByte ;
- 	  	if ( ! isCharByte ) return FALSE ;
- 		  advanceByte ;
- 		  if ( ! isCharByte ) return FALSE ;
- 		  advanceByte ;
- 		  if ( ! isCharByte ) return FALSE ;
- 		  continue ;
- 		}
-
- 		// we MUST be one of the above alternatives!
- 		return FALSE ;
-  }
-
-	return TRUE ;
-}
-
-void clearBuffer(char *buffer, size_t bufferSize) {
-	memset(buffer, 0, bufferSize) ;
-}
-
-int readRequest(int httpFD, char *buffer, size_t bufferSize) {
-  int curBytesRead  = 0 ;
-  char *curBuffer   = buffer ;
-  int curBufferSize = bufferSize ;
-
-  clearBuffer(buffer, bufferSize) ;
-
-  while (1) {
-  	int bytesRead = read(httpFD, curBuffer, curBufferSize) ;
-  	curBuffer[bytesRead] = 0 ;
-  	if (bytesRead < 0 ) {
-  	  // we have failed to read a new chunk...
-  		clearBuffer(buffer, bufferSize) ;
-  		return bytesRead ;
-  	}
-
-    // we update the current sizes...
-    //
-  	curBytesRead  += bytesRead ;
-  	curBufferSize -= bytesRead ;
-
-  	if (curBufferSize <= 0 ) {
-  	  // this chunk is TOO big...
-  		clearBuffer(buffer, bufferSize) ;
-  		return bufferSize ;
-  	}
-
-    // We ONLY proceed IF we have valid UTF-8!
-    //
-    if ( ! validUft8(buffer, curBytesRead) ) {
-    	return -2 ;
-    }
-
- 	  char *needleA = strcasestr(curBuffer, "Expect:") ;
-	  if ( needleA == 0 ) {
-	  	// No expect header found... return result as is...
- 	  	return curBytesRead ;
- 	  }
- 	  char *needleB = strcasestr(needleA, "100-continue") ;
- 	  if ( needleB == 0 ) {
- 	  	// No expect header found... return result as is...
- 	  	return curBytesRead ;
-  	}
-
-  	// An expect header has been found... so read another chunk...
-  	//
-    // we update the current pointers and try again...
-    //
-  	curBuffer     += bytesRead ;
-  }
-}
-
-void sendResponse(int httpFD, char *response) {
-  (void) write(httpFD, response, strlen(response) ) ;
-  shutdown(httpFD, SHUT_RDWR) ;
-  close(httpFD) ;
-}
-
 void runChildOnPort(int port, char* commentDir) {
 
 	logger("listening on port: %d\n", port) ;
@@ -329,6 +173,9 @@ void runChildOnPort(int port, char* commentDir) {
     logger("ERROR: could not listen to bound socket\n") ;
     exit(-1) ;
   }
+  static FileSink commentSink ;
+  initFileSink(&commentSink, commentDir, port) ;
+
   for ( size_t requestNum = 1 ; continueHandlingRequests ; requestNum++ ) {
     logger("\n") ;
     socklen_t length = sizeof(cli_addr);
@@ -338,89 +185,15 @@ void runChildOnPort(int port, char* commentDir) {
     	continue ;
     }
 
-    static char buffer[BUFFER_SIZE+1] ;
-    clearBuffer(buffer, BUFFER_SIZE+1) ;
-
-    clock_t begin = clock();
-    int bytesRead = readRequest( httpFD, buffer, BUFFER_SIZE );
-    if ( bytesRead == -2 ) {
-    	logger("ERROR: invalid UTF-8 while reading request %ld\n", requestNum);
-    	sendResponse(httpFD, invalidUft8) ;
-    	continue;
-    }
-    if ( bytesRead < 1 ) {
-    	logger("ERROR: Could not read request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, couldNotCollectComment) ;
-    	continue ;
-    }
-    clock_t endRead = clock();
-
-    if ( BUFFER_SIZE <= bytesRead ) {
-    	logger("ERROR: request too large: %ld\n", requestNum) ;
-    	sendResponse(httpFD, requestTooLarge) ;
-    	continue ;
-    }
-
-    if ( ! validUft8(buffer, bytesRead) ) {
-    	logger("ERROR: invalid utf8 for request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, invalidUft8) ;
-    	continue ;
-    }
-    clock_t endValid = clock();
-
-    char asciiTime[210];
-    memset(asciiTime, 0, 210) ;
-    time_t timeNow = time(0) ;
-    struct tm *timeNowStruct = localtime(&timeNow) ;
-    size_t timeSize = strftime(asciiTime, 200, "%Y-%m-%d_%H-%M-%S", timeNowStruct) ;
-    if ( timeSize == 0 ) {
-    	logger("ERROR: Could not construct asciiTime for request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, couldNotCollectComment) ;
-    	continue ;
-    }
-    char commentPath[BUFFER_SIZE];
-    memset(commentPath, 0, BUFFER_SIZE) ;
-    size_t commentPathSize = sprintf(
-      commentPath, "%s/%s_%d.comment", commentDir, asciiTime, port
-     ) ;
-    if ( commentPathSize < 1 ) {
-    	logger("ERROR: Could not construct commentPath for request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, couldNotCollectComment) ;
-    	continue ;
-    }
-    FILE *commentFile = fopen(commentPath, "w") ;
-    if ( !commentFile ) {
-    	logger("ERROR: could not open commentFile for request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, couldNotCollectComment) ;
-    	continue ;
-    }
-
-    int bytesWritten = fwrite( buffer, 1, bytesRead, commentFile ) ;
-    if ( bytesWritten != bytesRead ) {
-    	logger("ERROR: could not write commentFile for request: %ld\n", requestNum) ;
-    	sendResponse(httpFD, couldNotCollectComment) ;
-    	continue ;
-    }
-
-    fclose(commentFile) ;
-    logger("SUCCESS: captured comment: [%s] for request: %ld\n", commentPath, requestNum) ;
-  	sendResponse(httpFD, thankYou) ;
-    clock_t endWrite = clock();
-
-    double readTime  = (double)( endRead  - begin    ) / CLOCKS_PER_SEC ;
-    double validTime = (double)( endValid - endRead  ) / CLOCKS_PER_SEC ;
-    double writeTime = (double)( endWrite - endValid ) / CLOCKS_PER_SEC ;
-    double totalTime = (double)( endWrite - begin    ) / CLOCKS_PER_SEC ;
-
-    logger("%ld:  readTime: %f\n", requestNum, readTime) ;
-    logger("%ld: validTime: %f\n", requestNum, validTime) ;
-    logger("%ld: writeTime: %f\n", requestNum, writeTime) ;
-    logger("%ld: totalTime: %f\n", requestNum, totalTime) ;
+    FDTransport httpTransport ;
+    initFDTransport(&httpTransport, httpFD) ;
+    handleRequest(&httpTransport.transport, &commentSink.sink, requestNum) ;
   }
 }
 
 int main(int argc, char **argv) {
   myLogFile = stdout ;
+  setPipelineLogFile(myLogFile) ;
 
   if (argc < 4) {
   	logger("Usage: commentHttpServer <commentDir> <logDir> <aPort> [<ports>]\n") ;
@@ -465,9 +238,10 @@ int main(int argc, char **argv) {
   	}	else if (workerPid == 0 ) {
   		// Child process...
   		char logPathBuffer[BUFFER_SIZE+1] ;
-  		clearBuffer(logPathBuffer, BUFFER_SIZE+1) ;
+  		memset(logPathBuffer, 0, BUFFER_SIZE+1) ;
   		snprintf(logPathBuffer, BUFFER_SIZE, "%s/worker-%d.log", logDir, port) ;
   		myLogFile = fopen(logPathBuffer, "w") ;
+  		setPipelineLogFile(myLogFile) ;
   		pid_t myPid     = getpid() ;
   		logger("Starting child %d\n", myPid) ;
   		clearWorkerPids() ;
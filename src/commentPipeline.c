@@ -0,0 +1,831 @@
+/*! \file
+
+The request pipeline of the commentHttpServer, see commentPipeline.h
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "commentPipeline.h"
+
+static FILE *pipelineLogFile = NULL;
+#define logger(args...) do {                                  \
+  if (pipelineLogFile) {                                      \
+    fprintf(pipelineLogFile,##args) ; fflush(pipelineLogFile) ; \
+  }                                                           \
+} while (0)
+
+void setPipelineLogFile(FILE *aLogFile) {
+  pipelineLogFile = aLogFile ;
+}
+
+#define TRUE  1
+#define FALSE 0
+
+#define BUFFER_SIZE 8096
+
+// Requests whose Content-Length extends beyond our buffer are spliced
+// directly into a temporary comment file (up to MAX_LARGE_REQUEST_SIZE
+// bytes) and validated via an mmap of that file.
+//
+#define MAX_LARGE_REQUEST_SIZE  (1024*1024)
+#define SPLICE_CHUNK_SIZE       65536
+#define OVERFLOWED_REQUEST_SIZE SIZE_MAX
+
+static char *requestTooLarge =
+  "HTTP/1.1 413 Request too large \n"
+  "Content-Type: text/html\n\n"
+  "<html><head><title>Your comment is too large</title></head><body>"
+  "<h1>Your comment is too large</h1>\n"
+  "<p>Long comments are really papers in their own right.</p> "
+  "<p>Please consider publishing your own paper and then providing a "
+  "reference to it as a comment.</p>"
+  "</body></html>" ;
+
+static char *invalidUft8 =
+  "HTTP/1.1 415 Invalid UTF-8 \n"
+  "Content-Type: text/html\n\n"
+  "<html><head><title>Your comment is not valid utf-8</title></head><body>"
+  "<h1>Your comment is not valid utf-8</h1>\n"
+  "<p>We do not accept comments which are not valid utf-8</p>"
+  "</body></html>" ;
+
+static char *couldNotCollectComment =
+  "HTTP/1.1 500 Server error \n"
+  "Content-Type: text/html\n\n"
+  "<html><head><title>Sorry... we could not record you comment at the moment</title></head><body>"
+  "<h1>Sorry... we could not record you comment at the moment</h1>"
+  "<p>Something went wrong with our server and we could not deal with your "
+  "comment. Please try again later.</p>"
+  "</body></html>" ;
+
+static char *thankYou =
+  "HTTP/1.1 200 OK \n"
+  "Content-Type: text/html\n\n"
+  "<html><head><title>Thank you for your comment</title></head><body>"
+  "<h1>Thank you for your comment</h1>"
+  "<p>Thank you for your comment. Our editors will consider your comment to "
+  "determine if it conforms to our comment criteria.</p>"
+  "</body></html>" ;
+
+#define advanceByte {                        \
+	curByte++ ;                                \
+	if ( bufferEnd <= curByte ) return FALSE ; \
+}
+
+#define isOneByte    (( *curByte & 0b10000000 ) == 0b00000000 )
+#define isCharByte   (( *curByte & 0b11000000 ) == 0b10000000 )
+#define isTwoBytes   (( *curByte & 0b11100000 ) == 0b11000000 )
+#define isThreeBytes (( *curByte & 0b11110000 ) == 0b11100000 )
+#define isFourBytes  (( *curByte & 0b11111000 ) == 0b11110000 )
+
+////////////////////////////////////////////////////////////////////////
+// Transports
+
+static int writeAll(int fileFD, char *buffer, size_t numBytes) {
+  while ( 0 < numBytes ) {
+  	ssize_t bytesWritten = write(fileFD, buffer, numBytes) ;
+  	if ( bytesWritten < 0 ) {
+  	  if ( errno == EINTR ) continue ;
+  	  return FALSE ;
+  	}
+  	buffer   += bytesWritten ;
+  	numBytes -= bytesWritten ;
+  }
+  return TRUE ;
+}
+
+static ssize_t readFD(Transport *aTransport, char *buffer, size_t bufferSize) {
+  return read(((FDTransport*)aTransport)->fd, buffer, bufferSize) ;
+}
+
+static ssize_t writeFD(Transport *aTransport, char *buffer, size_t numBytes) {
+  return write(((FDTransport*)aTransport)->fd, buffer, numBytes) ;
+}
+
+/*!
+
+  Move numBytes from the socket into the file using splice(2) through an
+  intermediate pipe, so that the request body never enters user space.
+
+*/
+static int spliceFDToFile(Transport *aTransport, int fileFD, size_t numBytes) {
+  int httpFD = ((FDTransport*)aTransport)->fd ;
+  int pipeFDs[2] ;
+  if ( pipe(pipeFDs) < 0 ) return FALSE ;
+
+  int result = TRUE ;
+  while ( 0 < numBytes ) {
+  	size_t chunkSize = numBytes < SPLICE_CHUNK_SIZE ? numBytes : SPLICE_CHUNK_SIZE ;
+  	ssize_t bytesInPipe = splice(
+  	  httpFD, NULL, pipeFDs[1], NULL, chunkSize, SPLICE_F_MOVE | SPLICE_F_MORE
+  	) ;
+  	if ( ( bytesInPipe < 0 ) && ( errno == EINTR ) ) continue ;
+  	if ( bytesInPipe <= 0 ) {
+  	  // an error OR the client closed the connection early...
+  	  result = FALSE ;
+  	  break ;
+  	}
+  	numBytes -= bytesInPipe ;
+
+  	while ( 0 < bytesInPipe ) {
+  	  ssize_t bytesOut = splice(
+  	    pipeFDs[0], NULL, fileFD, NULL, bytesInPipe, SPLICE_F_MOVE | SPLICE_F_MORE
+  	  ) ;
+  	  if ( ( bytesOut < 0 ) && ( errno == EINTR ) ) continue ;
+  	  if ( bytesOut <= 0 ) {
+  	    result = FALSE ;
+  	    break ;
+  	  }
+  	  bytesInPipe -= bytesOut ;
+  	}
+  	if ( ! result ) break ;
+  }
+
+  close(pipeFDs[0]) ;
+  close(pipeFDs[1]) ;
+  return result ;
+}
+
+static void closeFD(Transport *aTransport) {
+  int httpFD = ((FDTransport*)aTransport)->fd ;
+  shutdown(httpFD, SHUT_RDWR) ;
+  close(httpFD) ;
+}
+
+void initFDTransport(FDTransport *aTransport, int fd) {
+  aTransport->transport.readBytes      = readFD ;
+  aTransport->transport.writeBytes     = writeFD ;
+  aTransport->transport.spliceToFile   = spliceFDToFile ;
+  aTransport->transport.closeTransport = closeFD ;
+  aTransport->fd                       = fd ;
+}
+
+static ssize_t readMemory(Transport *aTransport, char *buffer, size_t bufferSize) {
+  MemoryTransport *memory = (MemoryTransport*)aTransport ;
+  size_t numBytes = memory->inputSize - memory->inputOffset ;
+  if ( bufferSize < numBytes ) numBytes = bufferSize ;
+  memcpy(buffer, memory->input + memory->inputOffset, numBytes) ;
+  memory->inputOffset += numBytes ;
+  return numBytes ;
+}
+
+static ssize_t writeMemory(Transport *aTransport, char *buffer, size_t numBytes) {
+  MemoryTransport *memory = (MemoryTransport*)aTransport ;
+  size_t numFree = memory->outputSize - memory->outputLen ;
+  if ( numFree < numBytes ) numBytes = numFree ;
+  memcpy(memory->output + memory->outputLen, buffer, numBytes) ;
+  memory->outputLen += numBytes ;
+  return numBytes ;
+}
+
+/*!
+
+  There is no socket to splice from, so we write the remaining input
+  directly from memory.
+
+*/
+static int spliceMemoryToFile(Transport *aTransport, int fileFD, size_t numBytes) {
+  MemoryTransport *memory = (MemoryTransport*)aTransport ;
+  if ( memory->inputSize - memory->inputOffset < numBytes ) return FALSE ;
+  if ( ! writeAll(fileFD, memory->input + memory->inputOffset, numBytes) ) {
+    return FALSE ;
+  }
+  memory->inputOffset += numBytes ;
+  return TRUE ;
+}
+
+static void closeMemory(Transport *aTransport) {
+  ((MemoryTransport*)aTransport)->closed = TRUE ;
+}
+
+void initMemoryTransport(
+  MemoryTransport *aTransport,
+  char *input,  size_t inputSize,
+  char *output, size_t outputSize
+) {
+  aTransport->transport.readBytes      = readMemory ;
+  aTransport->transport.writeBytes     = writeMemory ;
+  aTransport->transport.spliceToFile   = spliceMemoryToFile ;
+  aTransport->transport.closeTransport = closeMemory ;
+  aTransport->input                    = input ;
+  aTransport->inputSize                = inputSize ;
+  aTransport->inputOffset              = 0 ;
+  aTransport->output                   = output ;
+  aTransport->outputSize               = outputSize ;
+  aTransport->outputLen                = 0 ;
+  aTransport->closed                   = FALSE ;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Comment sinks
+
+static int openFileSink(CommentSink *aSink) {
+  FileSink *file = (FileSink*)aSink ;
+
+  char asciiTime[210];
+  memset(asciiTime, 0, 210) ;
+  time_t timeNow = time(0) ;
+  struct tm *timeNowStruct = localtime(&timeNow) ;
+  size_t timeSize = strftime(asciiTime, 200, "%Y-%m-%d_%H-%M-%S", timeNowStruct) ;
+  if ( timeSize == 0 ) {
+  	logger("ERROR: Could not construct asciiTime for comment\n") ;
+  	return FALSE ;
+  }
+
+  memset(file->commentPath, 0, COMMENT_PIPELINE_PATH_SIZE) ;
+  int commentPathSize = snprintf(
+    file->commentPath, COMMENT_PIPELINE_PATH_SIZE, "%s/%s_%d.comment",
+    file->commentDir, asciiTime, file->port
+  ) ;
+  if ( ( commentPathSize < 1 ) || ( COMMENT_PIPELINE_PATH_SIZE <= commentPathSize ) ) {
+  	logger("ERROR: Could not construct commentPath\n") ;
+  	return FALSE ;
+  }
+
+  memset(file->tmpPath, 0, COMMENT_PIPELINE_PATH_SIZE+8) ;
+  snprintf(file->tmpPath, COMMENT_PIPELINE_PATH_SIZE+8, "%s.XXXXXX", file->commentPath) ;
+  file->fd = mkstemp(file->tmpPath) ;
+  if ( file->fd < 0 ) {
+    logger("ERROR: could not open temporary comment file [%s]\n", file->tmpPath) ;
+    return FALSE ;
+  }
+  fchmod(file->fd, 0644) ;
+  return TRUE ;
+}
+
+static int writeFileSink(CommentSink *aSink, char *buffer, size_t numBytes) {
+  return writeAll(((FileSink*)aSink)->fd, buffer, numBytes) ;
+}
+
+static int spliceFileSink(CommentSink *aSink, Transport *aTransport, size_t numBytes) {
+  return aTransport->spliceToFile(aTransport, ((FileSink*)aSink)->fd, numBytes) ;
+}
+
+static char *mapFileSink(CommentSink *aSink, size_t numBytes) {
+  char *fileBytes = mmap(
+    NULL, numBytes, PROT_READ, MAP_PRIVATE, ((FileSink*)aSink)->fd, 0
+  ) ;
+  if ( fileBytes == MAP_FAILED ) return NULL ;
+  madvise(fileBytes, numBytes, MADV_SEQUENTIAL) ;
+  return fileBytes ;
+}
+
+static void unmapFileSink(CommentSink *aSink, char *commentBytes, size_t numBytes) {
+  (void) aSink ;
+  munmap(commentBytes, numBytes) ;
+}
+
+/*!
+
+  Publish the comment by renaming the temporary file to the commentPath.
+
+*/
+static int commitFileSink(CommentSink *aSink) {
+  FileSink *file = (FileSink*)aSink ;
+  close(file->fd) ;
+  file->fd = -1 ;
+  if ( rename(file->tmpPath, file->commentPath) < 0 ) {
+    logger("ERROR: could not publish [%s] as [%s]\n", file->tmpPath, file->commentPath) ;
+    unlink(file->tmpPath) ;
+    return FALSE ;
+  }
+  logger("captured comment: [%s]\n", file->commentPath) ;
+  return TRUE ;
+}
+
+static void discardFileSink(CommentSink *aSink) {
+  FileSink *file = (FileSink*)aSink ;
+  close(file->fd) ;
+  file->fd = -1 ;
+  unlink(file->tmpPath) ;
+}
+
+void initFileSink(FileSink *aSink, char *commentDir, int port) {
+  aSink->sink.openComment    = openFileSink ;
+  aSink->sink.writeComment   = writeFileSink ;
+  aSink->sink.spliceComment  = spliceFileSink ;
+  aSink->sink.mapComment     = mapFileSink ;
+  aSink->sink.unmapComment   = unmapFileSink ;
+  aSink->sink.commitComment  = commitFileSink ;
+  aSink->sink.discardComment = discardFileSink ;
+  aSink->commentDir          = commentDir ;
+  aSink->port                = port ;
+  aSink->fd                  = -1 ;
+}
+
+static int openMemorySink(CommentSink *aSink) {
+  ((MemorySink*)aSink)->commentLen = 0 ;
+  return TRUE ;
+}
+
+static int writeMemorySink(CommentSink *aSink, char *buffer, size_t numBytes) {
+  MemorySink *memory = (MemorySink*)aSink ;
+  if ( memory->commentSize - memory->commentLen < numBytes ) return FALSE ;
+  memcpy(memory->comment + memory->commentLen, buffer, numBytes) ;
+  memory->commentLen += numBytes ;
+  return TRUE ;
+}
+
+/*!
+
+  There is no file to splice into, so we read the remainder of the request
+  directly into the comment.
+
+*/
+static int spliceMemorySink(CommentSink *aSink, Transport *aTransport, size_t numBytes) {
+  MemorySink *memory = (MemorySink*)aSink ;
+  if ( memory->commentSize - memory->commentLen < numBytes ) return FALSE ;
+  while ( 0 < numBytes ) {
+    ssize_t bytesRead = aTransport->readBytes(
+      aTransport, memory->comment + memory->commentLen, numBytes
+    ) ;
+    if ( ( bytesRead < 0 ) && ( errno == EINTR ) ) continue ;
+    if ( bytesRead <= 0 ) return FALSE ;
+    memory->commentLen += bytesRead ;
+    numBytes           -= bytesRead ;
+  }
+  return TRUE ;
+}
+
+static char *mapMemorySink(CommentSink *aSink, size_t numBytes) {
+  MemorySink *memory = (MemorySink*)aSink ;
+  if ( memory->commentLen < numBytes ) return NULL ;
+  return memory->comment ;
+}
+
+static void unmapMemorySink(CommentSink *aSink, char *commentBytes, size_t numBytes) {
+  (void) aSink ; (void) commentBytes ; (void) numBytes ;
+}
+
+static int commitMemorySink(CommentSink *aSink) {
+  ((MemorySink*)aSink)->numCommitted++ ;
+  return TRUE ;
+}
+
+static void discardMemorySink(CommentSink *aSink) {
+  MemorySink *memory = (MemorySink*)aSink ;
+  memory->commentLen = 0 ;
+  memory->numDiscarded++ ;
+}
+
+void initMemorySink(MemorySink *aSink, char *comment, size_t commentSize) {
+  aSink->sink.openComment    = openMemorySink ;
+  aSink->sink.writeComment   = writeMemorySink ;
+  aSink->sink.spliceComment  = spliceMemorySink ;
+  aSink->sink.mapComment     = mapMemorySink ;
+  aSink->sink.unmapComment   = unmapMemorySink ;
+  aSink->sink.commitComment  = commitMemorySink ;
+  aSink->sink.discardComment = discardMemorySink ;
+  aSink->comment             = comment ;
+  aSink->commentSize         = commentSize ;
+  aSink->commentLen          = 0 ;
+  aSink->numCommitted        = 0 ;
+  aSink->numDiscarded        = 0 ;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Validate the request to ensure it is valid UTF-8
+
+/*!
+
+  Work through the given buffer checking for valid UTF-8 tuples of bytes.
+
+  See: http://www.unicode.org/reports/tr36/ for UniCode security
+  considerations.
+
+*/
+static int validUft8Bytes( char *buffer, size_t numBytes) {
+  char *bufferEnd = buffer + numBytes ;
+  for (char *curByte = buffer; curByte < bufferEnd ; curByte++) {
+
+  	if ( isOneByte ) continue;
+
+    // the start of a utf-8 character MUST not be a "charByte"
+    if ( isCharByte ) return FALSE ;
+
+  	if ( isTwoBytes ) {
+  		advanceByte ;
+  		if ( ! isCharByte ) return FALSE ;
+      continue ;
+   	}
+
+   	if ( isThreeBytes ) {
+   		advanceByte ;
+   		if ( ! isCharByte ) return FALSE ;
+   		advanceByte ;
+   		if ( ! isCharByte ) return FALSE ;
+      continue ;
+   	}
+
+    if ( isFourBytes ) {
+   		advanceByte ;
+ 	  	if ( ! isCharByte ) return FALSE ;
+ 		  advanceByte ;
+ 		  if ( ! isCharByte ) return FALSE ;
+ 		  advanceByte ;
+ 		  if ( ! isCharByte ) return FALSE ;
+ 		  continue ;
+ 		}
+
+ 		// we MUST be one of the above alternatives!
+ 		return FALSE ;
+  }
+
+	return TRUE ;
+}
+
+/*!
+
+  Validate a NUL terminated buffer, which MUST not contain any embedded
+  NULs.
+
+*/
+static int validUft8( char *buffer, int bytesRead) {
+  if ( (int)(strlen(buffer)) != bytesRead ) {
+    logger("ERROR: incorrect buffer size validating utf-8\n") ;
+    return FALSE ;
+  }
+  return validUft8Bytes(buffer, bytesRead) ;
+}
+
+/*!
+
+  Validate a NUL terminated buffer which holds only the part of a request
+  read so far. The last read may have ended part way through a multi-byte
+  character (whose remaining bytes are still to come), so an incomplete
+  trailing character is accepted here. The complete request is validated
+  again once it has been read.
+
+*/
+static int validPartialUft8( char *buffer, int bytesRead) {
+  if ( (int)(strlen(buffer)) != bytesRead ) {
+    logger("ERROR: incorrect buffer size validating utf-8\n") ;
+    return FALSE ;
+  }
+
+  // find the start of the last character...
+  int lastStart = bytesRead - 1 ;
+  while ( ( 0 < lastStart ) && ( bytesRead - lastStart < 4 ) &&
+          ( ( buffer[lastStart] & 0b11000000 ) == 0b10000000 ) ) lastStart-- ;
+
+  int completeBytes = bytesRead ;
+  if ( 0 <= lastStart ) {
+    int lastSize = bytesRead - lastStart ;
+    unsigned char lastByte = buffer[lastStart] ;
+    if ( ( ( ( lastByte & 0b11100000 ) == 0b11000000 ) && ( lastSize < 2 ) ) ||
+         ( ( ( lastByte & 0b11110000 ) == 0b11100000 ) && ( lastSize < 3 ) ) ||
+         ( ( ( lastByte & 0b11111000 ) == 0b11110000 ) && ( lastSize < 4 ) ) ) {
+      completeBytes = lastStart ;
+    }
+  }
+
+  return validUft8Bytes(buffer, completeBytes) ;
+}
+
+static void clearBuffer(char *buffer, size_t bufferSize) {
+	memset(buffer, 0, bufferSize) ;
+}
+
+static int readRequest(Transport *aTransport, char *buffer, size_t bufferSize) {
+  int curBytesRead  = 0 ;
+  char *curBuffer   = buffer ;
+  int curBufferSize = bufferSize ;
+
+  clearBuffer(buffer, bufferSize) ;
+
+  while (1) {
+  	int bytesRead = aTransport->readBytes(aTransport, curBuffer, curBufferSize) ;
+  	if (bytesRead < 0 ) {
+  	  // we have failed to read a new chunk...
+  		clearBuffer(buffer, bufferSize) ;
+  		return bytesRead ;
+  	}
+  	curBuffer[bytesRead] = 0 ;
+
+    // we update the current sizes...
+    //
+  	curBytesRead  += bytesRead ;
+  	curBufferSize -= bytesRead ;
+
+  	if (curBufferSize <= 0 ) {
+  	  // this chunk is TOO big for the buffer... we leave what we have read
+  	  // so far in the buffer so that the caller can decide to splice the
+  	  // rest of the request into a file...
+  		return bufferSize ;
+  	}
+
+    // We ONLY proceed IF we have valid UTF-8!
+    //
+    if ( ! validPartialUft8(buffer, curBytesRead) ) {
+    	return -2 ;
+    }
+
+ 	  char *needleA = strcasestr(curBuffer, "Expect:") ;
+	  if ( needleA == 0 ) {
+	  	// No expect header found... return result as is...
+ 	  	return curBytesRead ;
+ 	  }
+ 	  char *needleB = strcasestr(needleA, "100-continue") ;
+ 	  if ( needleB == 0 ) {
+ 	  	// No expect header found... return result as is...
+ 	  	return curBytesRead ;
+  	}
+
+  	// An expect header has been found... so read another chunk...
+  	//
+    // we update the current pointers and try again...
+    //
+  	curBuffer     += bytesRead ;
+  }
+}
+
+/*!
+
+  Read the remainder of a request which fits into our buffer, but whose
+  body was not (completely) sent with its headers.
+
+*/
+static int readRemainder(
+  Transport *aTransport, char *buffer, size_t bytesRead, size_t totalSize
+) {
+  while ( bytesRead < totalSize ) {
+    ssize_t newBytes = aTransport->readBytes(
+      aTransport, buffer + bytesRead, totalSize - bytesRead
+    ) ;
+    if ( ( newBytes < 0 ) && ( errno == EINTR ) ) continue ;
+    if ( newBytes <= 0 ) return FALSE ;
+    bytesRead += newBytes ;
+  }
+  buffer[bytesRead] = 0 ;
+  return TRUE ;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Capture large requests without copying them through user space
+
+/*!
+
+  Determine the total size (headers plus body) of the request whose
+  (possibly partial) contents are in the NUL terminated buffer.
+
+  Only a complete "Content-Length:" header line (at the start of a line
+  inside the header block) is used.
+
+  Returns 0 if the end of the headers or a Content-Length header can not be
+  found. A Content-Length which is not a plain decimal number is ignored
+  (so the request is handled as it was read), and one which overflows
+  returns OVERFLOWED_REQUEST_SIZE (and so is far too large).
+
+*/
+static size_t requestSize(char *buffer) {
+  char *headerEnd = strstr(buffer, "\r\n\r\n") ;
+  if ( headerEnd == 0 ) return 0 ;
+
+  char *contentLength = strcasestr(buffer, "\r\nContent-Length:") ;
+  if ( ( contentLength == 0 ) || ( headerEnd <= contentLength ) ) return 0 ;
+  contentLength += strlen("\r\nContent-Length:") ;
+
+  while ( ( *contentLength == ' ' ) || ( *contentLength == '\t' ) ) contentLength++ ;
+  if ( ( *contentLength < '0' ) || ( '9' < *contentLength ) ) {
+    logger("ignoring malformed Content-Length\n") ;
+    return 0 ;
+  }
+
+  size_t headerSize = ( headerEnd - buffer ) + 4 ;
+  size_t bodySize   = 0 ;
+  for ( ; ( '0' <= *contentLength ) && ( *contentLength <= '9' ) ; contentLength++ ) {
+    size_t digit = *contentLength - '0' ;
+    if ( ( OVERFLOWED_REQUEST_SIZE - headerSize - digit ) / 10 < bodySize ) {
+      return OVERFLOWED_REQUEST_SIZE ;
+    }
+    bodySize = bodySize * 10 + digit ;
+  }
+
+  while ( ( *contentLength == ' ' ) || ( *contentLength == '\t' ) ) contentLength++ ;
+  if ( *contentLength != '\r' ) {
+    logger("ignoring malformed Content-Length\n") ;
+    return 0 ;
+  }
+
+  return headerSize + bodySize ;
+}
+
+/*!
+
+  Validate the UTF-8 of the whole (stored) comment by mapping it into
+  memory.
+
+*/
+static int validUft8Comment(CommentSink *aSink, size_t commentSize) {
+  char *commentBytes = aSink->mapComment(aSink, commentSize) ;
+  if ( ! commentBytes ) {
+    logger("ERROR: could not map comment to validate utf-8\n") ;
+    return FALSE ;
+  }
+
+  int result = TRUE ;
+  if ( memchr(commentBytes, 0, commentSize) ) result = FALSE ;
+  else result = validUft8Bytes(commentBytes, commentSize) ;
+
+  aSink->unmapComment(aSink, commentBytes, commentSize) ;
+  return result ;
+}
+
+/*!
+
+  Capture a request which is larger than our buffer.
+
+  The bytes already read into the buffer are written to a newly opened
+  comment, the remainder of the request is spliced from the transport into
+  this comment, and the whole comment is then validated. Valid comments are
+  committed, invalid comments are discarded.
+
+  Returns TRUE on success, -2 on invalid UTF-8 and FALSE on any other
+  error.
+
+*/
+static int captureLargeRequest(
+  Transport *aTransport, CommentSink *aSink,
+  char *buffer, size_t bytesRead, size_t totalSize
+) {
+  if ( ! aSink->openComment(aSink) ) {
+    logger("ERROR: could not open comment\n") ;
+    return FALSE ;
+  }
+
+  int result = aSink->writeComment(aSink, buffer, bytesRead) ;
+  if ( ! result ) {
+    logger("ERROR: could not write buffered request to comment\n") ;
+  }
+  if ( result ) {
+    result = aSink->spliceComment(aSink, aTransport, totalSize - bytesRead) ;
+    if ( ! result ) {
+      logger("ERROR: could not splice request into comment\n") ;
+    }
+  }
+  if ( result && ! validUft8Comment(aSink, totalSize) ) {
+    result = -2 ;
+  }
+
+  if ( result == TRUE ) {
+    result = aSink->commitComment(aSink) ;
+  } else {
+    aSink->discardComment(aSink) ;
+  }
+
+  return result ;
+}
+
+/*!
+
+  Capture a (small) request which has already been validated.
+
+*/
+static int captureRequest(CommentSink *aSink, char *buffer, size_t bytesRead) {
+  if ( ! aSink->openComment(aSink) ) {
+    logger("ERROR: could not open comment\n") ;
+    return FALSE ;
+  }
+  if ( ! aSink->writeComment(aSink, buffer, bytesRead) ) {
+    logger("ERROR: could not write comment\n") ;
+    aSink->discardComment(aSink) ;
+    return FALSE ;
+  }
+  return aSink->commitComment(aSink) ;
+}
+
+static void sendResponse(Transport *aTransport, char *response) {
+  (void) aTransport->writeBytes(aTransport, response, strlen(response) ) ;
+  aTransport->closeTransport(aTransport) ;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Handle one request
+
+/*!
+
+  We only pay for the clock when somebody is reading the log.
+
+*/
+static clock_t logClock(void) {
+  if ( ! pipelineLogFile ) return 0 ;
+  return clock() ;
+}
+
+int handleRequest(
+  Transport *aTransport, CommentSink *aSink, size_t requestNum
+) {
+  static char buffer[BUFFER_SIZE+1] ;
+  clearBuffer(buffer, BUFFER_SIZE+1) ;
+
+  clock_t begin = logClock();
+  int bytesRead = readRequest( aTransport, buffer, BUFFER_SIZE );
+  if ( bytesRead == -2 ) {
+  	logger("ERROR: invalid UTF-8 while reading request %ld\n", requestNum);
+  	sendResponse(aTransport, invalidUft8) ;
+  	return 415 ;
+  }
+  if ( bytesRead < 1 ) {
+  	logger("ERROR: Could not read request: %ld\n", requestNum) ;
+  	sendResponse(aTransport, couldNotCollectComment) ;
+  	return 500 ;
+  }
+  clock_t endRead = logClock();
+
+  // Any request whose body has not been completely read yet (because the
+  // client sent the headers separately) is either completed in our buffer
+  // or, if it does not fit into our buffer, spliced into its comment.
+  //
+  size_t totalSize = requestSize(buffer) ;
+  if ( totalSize <= (size_t)bytesRead ) totalSize = 0 ;
+
+  if ( totalSize && ( totalSize < BUFFER_SIZE ) ) {
+    if ( ! readRemainder(aTransport, buffer, bytesRead, totalSize) ) {
+  	  logger("ERROR: Could not read remainder of request: %ld\n", requestNum) ;
+  	  sendResponse(aTransport, couldNotCollectComment) ;
+  	  return 500 ;
+    }
+    bytesRead = totalSize ;
+    totalSize = 0 ;
+  }
+
+  if ( totalSize == OVERFLOWED_REQUEST_SIZE ) {
+  	logger("ERROR: Content-Length overflows for request: %ld\n", requestNum) ;
+  }
+  if ( ( ( BUFFER_SIZE <= bytesRead ) && ( totalSize == 0 ) ) ||
+       ( MAX_LARGE_REQUEST_SIZE < totalSize ) ) {
+  	logger("ERROR: request too large: %ld\n", requestNum) ;
+  	sendResponse(aTransport, requestTooLarge) ;
+  	return 413 ;
+  }
+
+  if ( totalSize ) {
+    logger("large request (%ld bytes) for request: %ld\n", totalSize, requestNum) ;
+    int captured = captureLargeRequest(
+      aTransport, aSink, buffer, bytesRead, totalSize
+    ) ;
+    if ( captured == -2 ) {
+  	  logger("ERROR: invalid utf8 for request: %ld\n", requestNum) ;
+  	  sendResponse(aTransport, invalidUft8) ;
+  	  return 415 ;
+    }
+    if ( ! captured ) {
+  	  logger("ERROR: could not capture large request: %ld\n", requestNum) ;
+  	  sendResponse(aTransport, couldNotCollectComment) ;
+  	  return 500 ;
+    }
+    logger("SUCCESS: captured comment for request: %ld\n", requestNum) ;
+    sendResponse(aTransport, thankYou) ;
+    if ( pipelineLogFile ) {
+      clock_t endWrite = clock();
+      logger("%ld: totalTime: %f\n", requestNum, (double)( endWrite - begin ) / CLOCKS_PER_SEC) ;
+    }
+    return 200 ;
+  }
+
+  if ( ! validUft8(buffer, bytesRead) ) {
+  	logger("ERROR: invalid utf8 for request: %ld\n", requestNum) ;
+  	sendResponse(aTransport, invalidUft8) ;
+  	return 415 ;
+  }
+  clock_t endValid = logClock();
+
+  if ( ! captureRequest(aSink, buffer, bytesRead) ) {
+  	logger("ERROR: could not capture request: %ld\n", requestNum) ;
+  	sendResponse(aTransport, couldNotCollectComment) ;
+  	return 500 ;
+  }
+
+  logger("SUCCESS: captured comment for request: %ld\n", requestNum) ;
+	sendResponse(aTransport, thankYou) ;
+
+  if ( pipelineLogFile ) {
+    clock_t endWrite = clock();
+
+    double readTime  = (double)( endRead  - begin    ) / CLOCKS_PER_SEC ;
+    double validTime = (double)( endValid - endRead  ) / CLOCKS_PER_SEC ;
+    double writeTime = (double)( endWrite - endValid ) / CLOCKS_PER_SEC ;
+    double totalTime = (double)( endWrite - begin    ) / CLOCKS_PER_SEC ;
+
+    logger("%ld:  readTime: %f\n", requestNum, readTime) ;
+    logger("%ld: validTime: %f\n", requestNum, validTime) ;
+    logger("%ld: writeTime: %f\n", requestNum, writeTime) ;
+    logger("%ld: totalTime: %f\n", requestNum, totalTime) ;
+  }
+
+  return 200 ;
+}
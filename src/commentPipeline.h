@@ -0,0 +1,179 @@
+/*! \file
+
+The request pipeline (read, validate, persist and respond) of the
+commentHttpServer.
+
+The pipeline does not know about sockets, worker processes or comment
+directories. All request bytes are read, and all response bytes are
+written, through a Transport. All comments are persisted through a
+CommentSink. We provide:
+
+ - an FDTransport which wraps a connected socket, and a FileSink which
+   writes comments into a comment directory (as used by the
+   commentHttpServer itself),
+
+ - a MemoryTransport which reads a request from, and writes the response
+   to, user supplied memory buffers, and a MemorySink which keeps the
+   comment in a user supplied memory buffer (as used by benchmarks and
+   fuzzers, which then never touch the network or the disk).
+
+The pipeline uses a static request buffer and so is NOT thread safe.
+
+*/
+
+#ifndef COMMENT_PIPELINE_H
+#define COMMENT_PIPELINE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*!
+
+  Log the pipeline's progress to aLogFile (by default, or if aLogFile is
+  NULL, nothing is logged).
+
+*/
+void setPipelineLogFile(FILE *aLogFile) ;
+
+////////////////////////////////////////////////////////////////////////
+// Transports
+
+/*!
+
+  A Transport is a small table of operations which the pipeline uses to
+  talk to its client.
+
+  - readBytes and writeBytes behave like read(2) and write(2).
+
+  - spliceToFile moves exactly numBytes of the request into the (open)
+    fileFD, returning non-zero on success.
+
+  - closeTransport is called once the response has been sent.
+
+*/
+typedef struct Transport {
+  ssize_t (*readBytes)(struct Transport *aTransport, char *buffer, size_t bufferSize) ;
+  ssize_t (*writeBytes)(struct Transport *aTransport, char *buffer, size_t numBytes) ;
+  int     (*spliceToFile)(struct Transport *aTransport, int fileFD, size_t numBytes) ;
+  void    (*closeTransport)(struct Transport *aTransport) ;
+} Transport ;
+
+typedef struct FDTransport {
+  Transport transport ;
+  int       fd ;
+} FDTransport ;
+
+void initFDTransport(FDTransport *aTransport, int fd) ;
+
+/*!
+
+  A MemoryTransport reads the request from input and appends the response
+  to output (truncating it to outputSize bytes). The outputLen and closed
+  fields may be inspected once the request has been handled.
+
+*/
+typedef struct MemoryTransport {
+  Transport transport ;
+  char     *input ;
+  size_t    inputSize ;
+  size_t    inputOffset ;
+  char     *output ;
+  size_t    outputSize ;
+  size_t    outputLen ;
+  int       closed ;
+} MemoryTransport ;
+
+void initMemoryTransport(
+  MemoryTransport *aTransport,
+  char *input,  size_t inputSize,
+  char *output, size_t outputSize
+) ;
+
+////////////////////////////////////////////////////////////////////////
+// Comment sinks
+
+/*!
+
+  A CommentSink is a small table of operations which the pipeline uses to
+  persist one comment at a time:
+
+  - openComment starts a new (empty) comment,
+
+  - writeComment appends numBytes from the buffer to the comment,
+
+  - spliceComment appends the next numBytes of the request, read from the
+    transport, to the comment,
+
+  - mapComment returns the first numBytes of the comment (so that they
+    can be validated), which are released by unmapComment,
+
+  - commitComment publishes the comment, discardComment throws it away.
+
+  All operations which return an int return non-zero on success.
+
+*/
+typedef struct CommentSink {
+  int   (*openComment)(struct CommentSink *aSink) ;
+  int   (*writeComment)(struct CommentSink *aSink, char *buffer, size_t numBytes) ;
+  int   (*spliceComment)(struct CommentSink *aSink, Transport *aTransport, size_t numBytes) ;
+  char *(*mapComment)(struct CommentSink *aSink, size_t numBytes) ;
+  void  (*unmapComment)(struct CommentSink *aSink, char *commentBytes, size_t numBytes) ;
+  int   (*commitComment)(struct CommentSink *aSink) ;
+  void  (*discardComment)(struct CommentSink *aSink) ;
+} CommentSink ;
+
+#define COMMENT_PIPELINE_PATH_SIZE 8096
+
+/*!
+
+  A FileSink writes each comment into a temporary file in the commentDir
+  and, on commit, renames it to <commentDir>/<time>_<port>.comment
+
+*/
+typedef struct FileSink {
+  CommentSink sink ;
+  char       *commentDir ;
+  int         port ;
+  int         fd ;
+  char        commentPath[COMMENT_PIPELINE_PATH_SIZE] ;
+  char        tmpPath[COMMENT_PIPELINE_PATH_SIZE+8] ;
+} FileSink ;
+
+void initFileSink(FileSink *aSink, char *commentDir, int port) ;
+
+/*!
+
+  A MemorySink keeps the current comment in the comment buffer (failing
+  comments larger than commentSize bytes). The commentLen, numCommitted and
+  numDiscarded fields may be inspected once a request has been handled.
+
+*/
+typedef struct MemorySink {
+  CommentSink sink ;
+  char       *comment ;
+  size_t      commentSize ;
+  size_t      commentLen ;
+  size_t      numCommitted ;
+  size_t      numDiscarded ;
+} MemorySink ;
+
+void initMemorySink(MemorySink *aSink, char *comment, size_t commentSize) ;
+
+////////////////////////////////////////////////////////////////////////
+// The pipeline
+
+/*!
+
+  Read, validate and persist (through the sink) one request from the
+  transport, send the appropriate response and close the transport.
+
+  The requestNum is only used for logging.
+
+  Returns the HTTP status code of the response sent.
+
+*/
+int handleRequest(
+  Transport *aTransport, CommentSink *aSink, size_t requestNum
+) ;
+
+#endif
@@ -0,0 +1,205 @@
+/*
+
+A very simple in-process benchmark of the commentHttpServer request
+pipeline.
+
+Each test file is wrapped in an HTTP POST request (with the correct
+Content-Length), or with --raw is sent as is (exactly like the testClient's
+sendRequest), through a MemoryTransport, so no sockets or worker processes
+are involved. Unless a comment directory is given, comments are persisted
+into a MemorySink, so the disk is not involved either.
+
+Each test file may be followed by the HTTP status we expect the pipeline to
+respond with (the default is 200), for example:
+
+  pipelineBench - 1000 testFiles/plainAscii testFiles/programData:415
+
+Every response is checked, and we exit with a non-zero status if any
+response was not the one expected.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commentPipeline.h"
+
+#define TRUE  1
+#define FALSE 0
+
+#define BUFFER_SIZE      8096
+#define HEADER_SIZE      256
+#define MAX_REQUEST_SIZE (2*1024*1024)
+
+char requestBuffer[HEADER_SIZE+MAX_REQUEST_SIZE+1] ;
+char responseBuffer[BUFFER_SIZE+1] ;
+char commentBuffer[HEADER_SIZE+MAX_REQUEST_SIZE+1] ;
+
+int rawRequests = FALSE ;
+
+/*
+
+  Load the test file into the requestBuffer, returning the length of the
+  request (or 0 on failure).
+
+*/
+size_t loadRequest(char *testFilePath) {
+  FILE *testFile = fopen(testFilePath, "r") ;
+  if (! testFile) {
+    printf("Could not open test file: %s\n", testFilePath ) ;
+    return 0 ;
+  }
+
+  memset(requestBuffer, 0, HEADER_SIZE+MAX_REQUEST_SIZE+1) ;
+  char *bodyBuffer = requestBuffer + HEADER_SIZE ;
+  size_t bodyLen = fread(bodyBuffer, 1, MAX_REQUEST_SIZE, testFile) ;
+  fclose(testFile) ;
+  if ( bodyLen < 1) {
+  	printf("Could not read test file: %s\n", testFilePath ) ;
+  	return 0 ;
+  }
+
+  if ( rawRequests ) {
+    memmove(requestBuffer, bodyBuffer, bodyLen) ;
+    requestBuffer[bodyLen] = 0 ;
+    return bodyLen ;
+  }
+
+  char header[HEADER_SIZE+1] ;
+  memset(header, 0, HEADER_SIZE+1) ;
+  int headerLen = snprintf(
+    header, HEADER_SIZE,
+    "POST / HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %ld\r\n"
+    "\r\n", bodyLen
+  ) ;
+  memmove(requestBuffer + headerLen, bodyBuffer, bodyLen) ;
+  memcpy(requestBuffer, header, headerLen) ;
+  requestBuffer[headerLen + bodyLen] = 0 ;
+  return headerLen + bodyLen ;
+}
+
+/*
+
+  Check that the pipeline responded, and (for a MemorySink) persisted, as
+  expected.
+
+*/
+int expectedResponse(
+  MemoryTransport *memory, MemorySink *memorySink, size_t numCommitted,
+  int status, int expectedStatus
+) {
+  if ( status != expectedStatus ) return FALSE ;
+
+  char statusLine[32] ;
+  snprintf(statusLine, 32, "HTTP/1.1 %d ", expectedStatus) ;
+  if ( ( memory->outputLen < strlen(statusLine) ) ||
+       ( strncmp(memory->output, statusLine, strlen(statusLine)) != 0 ) ) {
+    return FALSE ;
+  }
+  if ( ! memory->closed ) return FALSE ;
+
+  if ( memorySink ) {
+    size_t expectedCommitted = numCommitted + ( expectedStatus == 200 ? 1 : 0 ) ;
+    if ( memorySink->numCommitted != expectedCommitted ) return FALSE ;
+  }
+  return TRUE ;
+}
+
+int benchRequest(
+  CommentSink *aSink, MemorySink *memorySink, char *testArg, size_t numRequests
+) {
+
+  printf("\n") ;
+
+  char testFilePath[BUFFER_SIZE+1] ;
+  memset(testFilePath, 0, BUFFER_SIZE+1) ;
+  strncpy(testFilePath, testArg, BUFFER_SIZE) ;
+  int expectedStatus = 200 ;
+  char *statusArg = strrchr(testFilePath, ':') ;
+  if ( statusArg ) {
+    *statusArg = 0 ;
+    expectedStatus = atoi(statusArg+1) ;
+  }
+
+  size_t requestLen = loadRequest(testFilePath) ;
+  if ( requestLen < 1 ) return FALSE ;
+
+  size_t numExpected = 0 ;
+  struct timespec begin, end ;
+  clock_gettime(CLOCK_MONOTONIC, &begin) ;
+
+  for (size_t requestNum = 1 ; requestNum <= numRequests ; requestNum++ ) {
+    MemoryTransport memory ;
+    initMemoryTransport(
+      &memory, requestBuffer, requestLen, responseBuffer, BUFFER_SIZE
+    ) ;
+    size_t numCommitted = memorySink ? memorySink->numCommitted : 0 ;
+    int status = handleRequest(&memory.transport, aSink, requestNum) ;
+    if ( expectedResponse(
+      &memory, memorySink, numCommitted, status, expectedStatus
+    ) ) numExpected++ ;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end) ;
+  double totalTime = (double)( end.tv_sec  - begin.tv_sec  ) +
+                     (double)( end.tv_nsec - begin.tv_nsec ) / 1e9 ;
+
+  printf("%s (%ld bytes)\n", testFilePath, requestLen) ;
+  printf("  requests: %ld (%ld responded %d as expected)\n",
+    numRequests, numExpected, expectedStatus) ;
+  printf("  totalTime: %f\n", totalTime) ;
+  printf("  requests/sec: %f\n", numRequests / totalTime) ;
+
+  if ( numExpected != numRequests ) {
+    printf("FAILED: %s\n", testFilePath) ;
+    return FALSE ;
+  }
+  return TRUE ;
+}
+
+int main(int argc, char **argv) {
+
+  int firstArg = 1 ;
+  if ( ( 1 < argc ) && ( strcmp(argv[1], "--raw") == 0 ) ) {
+    rawRequests = TRUE ;
+    firstArg++ ;
+  }
+
+  if (argc < firstArg + 3) {
+  	printf("Usage: pipelineBench [--raw] <commentDir|-> <numRequests> <testFile>[:<status>] [<testFiles>]\n") ;
+  	exit(-1) ;
+  }
+
+  char   *commentDir  = argv[firstArg] ;
+  size_t  numRequests = atol(argv[firstArg+1]) ;
+
+  // a commentDir of "-" keeps the comments in memory...
+  static FileSink fileSink ;
+  MemorySink      memorySink ;
+  MemorySink     *checkedSink = &memorySink ;
+  CommentSink    *commentSink = &memorySink.sink ;
+  initMemorySink(&memorySink, commentBuffer, HEADER_SIZE+MAX_REQUEST_SIZE) ;
+  if ( strcmp(commentDir, "-") != 0 ) {
+    initFileSink(&fileSink, commentDir, 0) ;
+    commentSink = &fileSink.sink ;
+    checkedSink = NULL ;
+  }
+
+  // we do not want to benchmark the logging...
+  setPipelineLogFile(NULL) ;
+
+  int result = 0 ;
+  for (int aTestFile = firstArg + 2 ; aTestFile < argc ; aTestFile++ ) {
+    if (! benchRequest(commentSink, checkedSink, argv[aTestFile], numRequests) ) {
+      result = -1 ;
+    }
+  }
+  return result ;
+}
@@ -10,7 +10,10 @@ A very simple client to test the commentHttpServer.
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -19,6 +22,8 @@ A very simple client to test the commentHttpServer.
 #define FALSE 0
 #define IP_ADDRESS "127.0.0.1"
 #define BUFFER_SIZE 8196
+#define SPLIT_BUFFER_SIZE 32768
+#define TOO_LARGE_SIZE (1100*1000)
 
 static struct sockaddr_in serv_addr;
 
@@ -104,16 +109,83 @@ void sendRequest(int port, char *testFileName, char *responseKey) {
     printf("SUCCESS: %s\n", testFileName) ;
 }
 
-int curledRequest(int port, char *testFileName, char *responseKey) {
+/*
+
+  Send a valid UTF-8 request whose body (numChars two byte characters) is
+  written in two parts, the first of which ends part way through a
+  character.
+
+*/
+int sentSplitRequest(int port, size_t numChars, size_t splitAt, char *responseKey) {
+
   printf("\n") ;
 
-  char testFilePath[BUFFER_SIZE+1];
-  memset(testFilePath, 0, BUFFER_SIZE+1) ;
-  if (snprintf(testFilePath, BUFFER_SIZE, "testFiles/%s", testFileName) < 0) {
-    printf("Could not create testFilePath for %s\n", testFileName)	;
+  static char requestBuffer[SPLIT_BUFFER_SIZE+1];
+  memset(requestBuffer, 0, SPLIT_BUFFER_SIZE+1) ;
+  int headerLen = snprintf(
+    requestBuffer, SPLIT_BUFFER_SIZE,
+    "POST / HTTP/1.1\r\nContent-Type: text/plain\r\nContent-Length: %ld\r\n\r\n",
+    2*numChars
+  ) ;
+  if ( ( headerLen < 0 ) || ( SPLIT_BUFFER_SIZE < headerLen + 2*numChars ) ) {
+    printf("Could not create split request of %ld characters\n", numChars) ;
+    return FALSE ;
+  }
+  char *body = requestBuffer + headerLen ;
+  for (size_t aChar = 0 ; aChar < numChars ; aChar++) {
+    body[2*aChar]   = (char)0xC3 ; // "é"
+    body[2*aChar+1] = (char)0xA9 ;
+  }
+  size_t requestLen = headerLen + 2*numChars ;
+  size_t firstLen   = headerLen + splitAt ;
+
+	int serverFD = socket(AF_INET, SOCK_STREAM, 0 ) ;
+	if( serverFD < 0 ) {
+  	printf("Could not connect to http://%s:%d\n", IP_ADDRESS, port) ;
+	  return FALSE ;
+	}
+
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = inet_addr(IP_ADDRESS);
+  serv_addr.sin_port = htons(port);
+
+  if(connect(serverFD, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 ) {
+  	printf("ERROR: Could not connect to http://%s:%d\n", IP_ADDRESS, port) ;
+  	return FALSE ;
+  }
+
+	write(serverFD, requestBuffer, firstLen ) ;
+	usleep(200000) ;
+	write(serverFD, requestBuffer + firstLen, requestLen - firstLen ) ;
+
+  char responseBuffer[BUFFER_SIZE+1];
+  memset(responseBuffer, 0, BUFFER_SIZE+1) ;
+  int bytesRead = read(serverFD, responseBuffer, BUFFER_SIZE ) ;
+  shutdown(serverFD, SHUT_RDWR) ;
+  close(serverFD) ;
+
+  if ( bytesRead < 1 ) {
+    printf("Could not read from server\n") ;
     return FALSE ;
   }
+  if ( strcasestr(responseBuffer, responseKey) == 0 ) {
+  	printf("WRONG: status\n") ;
+  	char *eol = strchr(responseBuffer, '\n') ;
+  	if (eol) *eol = 0;
+    printf("  [%s]\n", responseBuffer) ;
+    return FALSE ;
+  }
+  return TRUE ;
+}
+
+void sendSplitRequest(int port, size_t numChars, size_t splitAt, char *responseKey) {
+  if (! sentSplitRequest(port, numChars, splitAt, responseKey) )
+    printf("FAILED: split request (%ld characters at %ld)\n", numChars, splitAt) ;
+  else
+    printf("SUCCESS: split request (%ld characters at %ld)\n", numChars, splitAt) ;
+}
 
+int curledPath(int port, char *testFilePath, char *responseKey) {
   char cmdBuffer[BUFFER_SIZE+1];
   memset(cmdBuffer, 0, BUFFER_SIZE+1) ;
   if (snprintf(
@@ -160,6 +232,19 @@ int curledRequest(int port, char *testFileName, char *responseKey) {
 	return TRUE ;
 }
 
+int curledRequest(int port, char *testFileName, char *responseKey) {
+  printf("\n") ;
+
+  char testFilePath[BUFFER_SIZE+1];
+  memset(testFilePath, 0, BUFFER_SIZE+1) ;
+  if (snprintf(testFilePath, BUFFER_SIZE, "testFiles/%s", testFileName) < 0) {
+    printf("Could not create testFilePath for %s\n", testFileName)	;
+    return FALSE ;
+  }
+
+  return curledPath(port, testFilePath, responseKey) ;
+}
+
 void curlRequest(int port, char *testFileName, char *responseKey) {
 	if (! curledRequest(port, testFileName, responseKey) )
     printf("FAILED: %s\n", testFileName) ;
@@ -167,19 +252,113 @@ void curlRequest(int port, char *testFileName, char *responseKey) {
     printf("SUCCESS: %s\n", testFileName) ;
 }
 
+/*
+
+  Check that nothing in the commentDir (neither a comment nor a temporary
+  file) has been written since the startTime.
+
+*/
+int noCommentsSince(char *commentDir, struct timespec startTime) {
+  DIR *dir = opendir(commentDir) ;
+  if (! dir) {
+    printf("Could not open comment directory: %s\n", commentDir) ;
+    return FALSE ;
+  }
+
+  int result = TRUE ;
+  struct dirent *entry ;
+  while ( (entry = readdir(dir)) ) {
+    if (entry->d_name[0] == '.') continue ;
+
+    char entryPath[BUFFER_SIZE+1];
+    memset(entryPath, 0, BUFFER_SIZE+1) ;
+    snprintf(entryPath, BUFFER_SIZE, "%s/%s", commentDir, entry->d_name) ;
+
+    struct stat entryStat ;
+    if ( stat(entryPath, &entryStat) < 0 ) continue ;
+    if ( ( startTime.tv_sec < entryStat.st_mtim.tv_sec ) ||
+         ( ( startTime.tv_sec == entryStat.st_mtim.tv_sec ) &&
+           ( startTime.tv_nsec <= entryStat.st_mtim.tv_nsec ) ) ) {
+      printf("Found new file: %s\n", entryPath) ;
+      result = FALSE ;
+    }
+  }
+  closedir(dir) ;
+  return result ;
+}
+
+void curlUncapturedRequest(
+  int port, char *commentDir, char *testFileName, char *responseKey
+) {
+  struct timespec startTime ;
+  clock_gettime(CLOCK_REALTIME, &startTime) ;
+
+	if (! curledRequest(port, testFileName, responseKey) )
+    printf("FAILED: %s\n", testFileName) ;
+  else if ( commentDir && ! noCommentsSince(commentDir, startTime) )
+    printf("FAILED: %s (comment captured)\n", testFileName) ;
+  else
+    printf("SUCCESS: %s\n", testFileName) ;
+}
+
+/*
+
+  Curl a plain ascii comment which is larger than the server's
+  MAX_LARGE_REQUEST_SIZE (1MiB). The comment is generated into a temporary
+  file, rather than being kept in testFiles.
+
+*/
+void curlTooLargeRequest(int port, char *commentDir, char *responseKey) {
+  printf("\n") ;
+
+  char testFilePath[] = "/tmp/tooLargeAscii-XXXXXX" ;
+  int testFD = mkstemp(testFilePath) ;
+  FILE *testFile = NULL ;
+  if ( 0 <= testFD ) testFile = fdopen(testFD, "w") ;
+  if (! testFile) {
+    printf("Could not create test file: %s\n", testFilePath ) ;
+    printf("FAILED: tooLargeAscii\n") ;
+    return ;
+  }
+  char *line =
+    "This is a line of plain ascii which is repeated to make a comment "
+    "which is too large.\n" ;
+  for (size_t fileSize = 0 ; fileSize < TOO_LARGE_SIZE ; fileSize += strlen(line)) {
+    fputs(line, testFile) ;
+  }
+  fclose(testFile) ;
+
+  struct timespec startTime ;
+  clock_gettime(CLOCK_REALTIME, &startTime) ;
+
+	if (! curledPath(port, testFilePath, responseKey) )
+    printf("FAILED: tooLargeAscii\n") ;
+  else if ( commentDir && ! noCommentsSince(commentDir, startTime) )
+    printf("FAILED: tooLargeAscii (comment captured)\n") ;
+  else
+    printf("SUCCESS: tooLargeAscii\n") ;
+
+  unlink(testFilePath) ;
+}
+
 int main(int argc, char **argv) {
 
   if (argc < 2) {
-  	printf("Usage: testClient <port>\n") ;
+  	printf("Usage: testClient <port> [<commentDir>]\n") ;
   	exit(-1) ;
   }
 
 	int port = atoi(argv[1]) ;
 
+	// if we know the server's comment directory we also check that
+	// rejected comments leave nothing behind...
+	char *commentDir = NULL ;
+	if (2 < argc) commentDir = argv[2] ;
+
 	sendRequest(port, "plainAscii", "OK") ;
 	curlRequest(port, "plainAscii", "Thank you for your comment") ;
   sendRequest(port, "programData", "too large") ;
-  curlRequest(port, "programData", "too large") ;
+  curlRequest(port, "programData", "not valid utf-8") ;
   sendRequest(port, "shortProgDataA", "Invalid UTF-8") ;
   curlRequest(port, "shortProgDataA", "not valid utf-8") ;
   sendRequest(port, "shortProgDataA-noNulls", "Invalid UTF-8") ;
@@ -192,5 +371,10 @@ int main(int argc, char **argv) {
   curlRequest(port, "UTF-8-demoA", "Thank you for your comment") ;
   sendRequest(port, "UTF-8-demoB", "OK") ;
   curlRequest(port, "UTF-8-demoB", "Thank you for your comment") ;
+  sendSplitRequest(port, 100, 51, "OK") ;
+  sendSplitRequest(port, 12000, 1001, "OK") ;
+  curlRequest(port, "largeUTF-8", "Thank you for your comment") ;
+  curlUncapturedRequest(port, commentDir, "largeInvalidUTF-8", "not valid utf-8") ;
+  curlTooLargeRequest(port, commentDir, "too large") ;
 
 }
\ No newline at end of file